@@ -1,12 +1,57 @@
 // Sequence Binary Tree - AVL Tree
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
+
+// Immutable, reference counted text storage shared between slices.
+// refcount isn't atomic, trees are only touched from one thread.
+typedef struct Buffer {
+    uint32_t refcount = 1;
+    uint32_t length = 0;
+    char* data = nullptr;
+} Buffer;
+
+// View of [offset, offset + length) in buf.
+typedef struct Slice {
+    Buffer* buf = nullptr;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+} Slice;
+
+Buffer* init_Buffer(const char* data, uint32_t length) {
+    Buffer* buf = new Buffer();
+    buf->length = length;
+    buf->data = new char[length];
+    memcpy(buf->data, data, length);
+    return buf;
+}
+
+Slice retain_slice(Slice slice) {
+    if (slice.buf != nullptr)
+        slice.buf->refcount += 1;
+    return slice;
+}
+
+void release_slice(Slice slice) {
+    if (slice.buf == nullptr)
+        return;
+    assert((slice.buf->refcount > 0) && "Buffer released too many times");
+    slice.buf->refcount -= 1;
+    if (slice.buf->refcount == 0) {
+        delete[] slice.buf->data;
+        delete slice.buf;
+    }
+}
 
 typedef struct AVLNode {
     uint32_t height = 0;
     uint32_t size = 1;
+    uint32_t chars = 0; // sum of chunk lengths in the subtree
     int32_t val = -1;
+    Slice chunk;
     AVLNode* parent = nullptr;
     AVLNode* left = nullptr;
     AVLNode* right = nullptr;
@@ -24,6 +69,12 @@ uint32_t get_size(AVLNode* node) {
     return 0;
 }
 
+uint32_t get_chars(AVLNode* node) {
+    if (node != nullptr)
+        return node->chars;
+    return 0;
+}
+
 uint32_t compute_skew(AVLNode* node) {
     assert(node != nullptr && "Compute skew has a nullptr node");
     return get_height(node->right) - get_height(node->left);
@@ -43,6 +94,12 @@ AVLNode* get_leftmost(AVLNode* node) {
     return get_leftmost(node->left);
 }
 
+AVLNode* get_rightmost(AVLNode* node) {
+    if (node->right == nullptr)
+        return node;
+    return get_rightmost(node->right);
+}
+
 AVLNode* get_succ(AVLNode* node) {
     if (node->right != nullptr)
         return get_leftmost(node->right);
@@ -103,6 +160,7 @@ void update_augments(AVLNode* naya) {
     while (cur != nullptr) {
         // cur->size += 1;
         cur->size = get_size(cur->left) + get_size(cur->right) + 1;
+        cur->chars = get_chars(cur->left) + get_chars(cur->right) + cur->chunk.length;
         cur->height = std::max(get_height(cur->left), get_height(cur->right)) + 1;
         cur = cur->parent;
     }
@@ -206,22 +264,32 @@ void insert_last(AVLTree* tree, AVLNode* cur_root, AVLNode* naya) {
         insert_last(tree, cur_root->right, naya);
 }
 
-void insert_node(AVLTree* tree, int32_t val, uint32_t idx) {
-    AVLNode* naya = init_AVLNode(val);
-    AVLNode* parent = subtree_at(tree->root, idx);
-    if (parent == nullptr)
-        tree->root = naya;
-    else if (parent->right == nullptr) {
-        parent->right = naya;
-        naya->parent = parent;
+// Puts naya right after prev in the sequence, prev == nullptr puts it first.
+void insert_after(AVLTree* tree, AVLNode* prev, AVLNode* naya) {
+    if (prev == nullptr) {
+        if (tree->root == nullptr)
+            tree->root = naya;
+        else
+            insert_first(tree, tree->root, naya);
+    } else if (prev->right == nullptr) {
+        prev->right = naya;
+        naya->parent = prev;
     } else
-        insert_first(tree, parent->right, naya);
+        insert_first(tree, prev->right, naya);
     update_augments(naya);
     rebalance(tree, naya);
 }
 
+void insert_node(AVLTree* tree, int32_t val, uint32_t idx) {
+    assert((idx <= get_size(tree->root)) && "Insert index is out of bounds");
+    AVLNode* naya = init_AVLNode(val);
+    insert_after(tree, subtree_at(tree->root, idx), naya);
+}
+
+// Only for value nodes, doesn't release chunks or keep chars up to date.
 void delete_node(AVLTree* tree, uint32_t idx) {
     AVLNode* node = subtree_at(tree->root, idx);
+    assert((node->chunk.buf == nullptr) && "delete_node doesn't support text nodes");
 
     // leaf case
     if (node->left == nullptr && node->right == nullptr)
@@ -273,6 +341,175 @@ void tree_printer(AVLNode* node) {
     return;
 }
 
+// Text on top of the sequence tree
+// Every node carries a chunk, a slice into a shared Buffer, and chars
+// gives char positions. substr, paste and concat only copy slices and bump
+// refcounts; bytes get copied when a chunk is mutated while shared.
+
+AVLNode* init_chunk_AVLNode(Slice chunk) {
+    AVLNode* node = new AVLNode();
+    node->chunk = chunk;
+    node->chars = chunk.length;
+    return node;
+}
+
+// Node holding char *pos, *pos is updated to the offset inside that node's chunk.
+AVLNode* node_at_char(AVLNode* node, uint32_t* pos) {
+    assert((*pos < get_chars(node)) && "Char position is out of bounds");
+    while (node != nullptr) {
+        uint32_t left_chars = get_chars(node->left);
+        if (*pos < left_chars)
+            node = node->left;
+        else if (*pos < left_chars + node->chunk.length) {
+            *pos -= left_chars;
+            return node;
+        } else {
+            *pos -= left_chars + node->chunk.length;
+            node = node->right;
+        }
+    }
+    assert(false && "Char position is out of bounds");
+    return nullptr;
+}
+
+// Makes sure a chunk ends exactly at pos, splitting one if needed.
+// Returns the node whose chunk ends at pos, nullptr when pos is 0.
+// Both halves of a split share the same buffer.
+AVLNode* split_at(AVLTree* tree, uint32_t pos) {
+    assert((pos <= get_chars(tree->root)) && "Split position is out of bounds");
+    if (pos == 0)
+        return nullptr;
+    uint32_t off = pos - 1;
+    AVLNode* node = node_at_char(tree->root, &off);
+    off += 1;
+    if (off < node->chunk.length) {
+        Slice rest = retain_slice(node->chunk);
+        rest.offset += off;
+        rest.length -= off;
+        node->chunk.length = off;
+        update_augments(node);
+        insert_after(tree, node, init_chunk_AVLNode(rest));
+    }
+    return node;
+}
+
+// Appends retained slices covering [pos, pos + len) of the subtree to out.
+void collect_slices(AVLNode* node, uint32_t pos, uint32_t len, std::vector<Slice>* out) {
+    if (node == nullptr || len == 0)
+        return;
+    uint32_t left_chars = get_chars(node->left);
+    if (pos < left_chars)
+        collect_slices(node->left, pos, len, out);
+    uint32_t start = left_chars;
+    uint32_t end = left_chars + node->chunk.length;
+    if (pos < end && pos + len > start) {
+        uint32_t from = std::max(pos, start);
+        uint32_t to = std::min(pos + len, end);
+        Slice part = retain_slice(node->chunk);
+        part.offset += from - start;
+        part.length = to - from;
+        out->push_back(part);
+    }
+    if (pos + len > end)
+        collect_slices(node->right, pos > end ? pos - end : 0, pos + len - std::max(pos, end), out);
+}
+
+// Takes ownership of the slices.
+void insert_slices(AVLTree* tree, uint32_t pos, const std::vector<Slice>& slices) {
+    AVLNode* prev = split_at(tree, pos);
+    for (const Slice& slice : slices) {
+        if (slice.length == 0) {
+            release_slice(slice);
+            continue;
+        }
+        AVLNode* naya = init_chunk_AVLNode(slice);
+        insert_after(tree, prev, naya);
+        prev = naya;
+    }
+}
+
+// Copies data once into a fresh buffer and inserts it at pos.
+void insert_text(AVLTree* tree, uint32_t pos, const char* data, uint32_t len) {
+    if (len == 0)
+        return;
+    Slice slice;
+    slice.buf = init_Buffer(data, len);
+    slice.length = len;
+    insert_slices(tree, pos, {slice});
+}
+
+// New tree viewing [pos, pos + len) of tree, no bytes are copied.
+AVLTree* substr(AVLTree* tree, uint32_t pos, uint32_t len) {
+    assert((pos + len <= get_chars(tree->root)) && "Substring is out of bounds");
+    std::vector<Slice> slices;
+    collect_slices(tree->root, pos, len, &slices);
+    AVLTree* naya = new AVLTree();
+    insert_slices(naya, 0, slices);
+    return naya;
+}
+
+// Inserts [src_pos, src_pos + len) of src at dest_pos in dest, sharing the bytes.
+// src and dest can be the same tree.
+void paste(AVLTree* dest, uint32_t dest_pos, AVLTree* src, uint32_t src_pos, uint32_t len) {
+    assert((src_pos + len <= get_chars(src->root)) && "Copied range is out of bounds");
+    std::vector<Slice> slices;
+    collect_slices(src->root, src_pos, len, &slices);
+    insert_slices(dest, dest_pos, slices);
+}
+
+// Appends all of src to dest, src is left untouched.
+void concat(AVLTree* dest, AVLTree* src) { paste(dest, get_chars(dest->root), src, 0, get_chars(src->root)); }
+
+// Max bytes set_char copies out of a shared buffer at once.
+constexpr uint32_t COW_WINDOW = 4096;
+
+// Copy on write. If the buffer is shared, the COW_WINDOW aligned window of the
+// chunk around pos is split off and only that gets a private buffer. Later
+// writes into the window then happen in place.
+void set_char(AVLTree* tree, uint32_t pos, char c) {
+    uint32_t off = pos;
+    AVLNode* node = node_at_char(tree->root, &off);
+    if (node->chunk.buf->refcount > 1) {
+        uint32_t chunk_start = pos - off;
+        uint32_t window_start = off - off % COW_WINDOW;
+        uint32_t window_end = std::min(window_start + COW_WINDOW, node->chunk.length);
+        split_at(tree, chunk_start + window_start);
+        node = split_at(tree, chunk_start + window_end);
+        off -= window_start;
+        assert((node->chunk.length == window_end - window_start) && "Window wasn't isolated");
+        if (node->chunk.buf->refcount > 1) {
+            Buffer* own = init_Buffer(node->chunk.buf->data + node->chunk.offset, node->chunk.length);
+            release_slice(node->chunk);
+            node->chunk.buf = own;
+            node->chunk.offset = 0;
+        }
+    }
+    node->chunk.buf->data[node->chunk.offset + off] = c;
+}
+
+void text_of(AVLNode* node, std::string* out) {
+    if (node == nullptr)
+        return;
+    text_of(node->left, out);
+    if (node->chunk.buf != nullptr)
+        out->append(node->chunk.buf->data + node->chunk.offset, node->chunk.length);
+    text_of(node->right, out);
+}
+
+void free_subtree(AVLNode* node) {
+    if (node == nullptr)
+        return;
+    free_subtree(node->left);
+    free_subtree(node->right);
+    release_slice(node->chunk);
+    delete node;
+}
+
+void free_tree(AVLTree* tree) {
+    free_subtree(tree->root);
+    delete tree;
+}
+
 // adds numbers in insert_last fashion, traverses and delete them
 bool test_1() {
     AVLTree* tree = new AVLTree();
@@ -314,7 +551,88 @@ bool test_2() {
     return true;
 }
 
+// substr, paste and concat share buffers, set_char only copies the chunk it touches
+bool test_3() {
+    AVLTree* tree = new AVLTree();
+    insert_text(tree, 0, "hello world", 11);
+    insert_text(tree, 5, ",", 1);
+    insert_text(tree, 12, "!", 1);
+    std::string text;
+    text_of(tree->root, &text);
+    assert((text == "hello, world!") && "insert_text order doesn't match");
+    sanitize(tree->root);
+
+    AVLTree* sub = substr(tree, 3, 7);
+    text.clear();
+    text_of(sub->root, &text);
+    assert((text == "lo, wor") && "substr doesn't match");
+    assert((get_leftmost(sub->root)->chunk.buf->data == get_leftmost(tree->root)->chunk.buf->data) &&
+           "substr copied bytes");
+
+    paste(tree, 0, tree, 7, 5);
+    concat(tree, sub);
+    text.clear();
+    text_of(tree->root, &text);
+    assert((text == "worldhello, world!lo, wor") && "paste or concat doesn't match");
+
+    uint32_t shared = get_leftmost(tree->root)->chunk.buf->refcount;
+    set_char(tree, 0, 'W');
+    text.clear();
+    text_of(tree->root, &text);
+    assert((text == "Worldhello, world!lo, wor") && "set_char doesn't match");
+    text.clear();
+    text_of(sub->root, &text);
+    assert((text == "lo, wor") && "set_char leaked into a shared view");
+    assert((get_leftmost(tree->root)->chunk.buf->refcount == 1) && "Mutated chunk isn't private");
+    uint32_t pos = 7;
+    assert((node_at_char(tree->root, &pos)->chunk.buf->refcount == shared - 1) && "Old buffer wasn't released");
+
+    // writes into a big shared chunk only copy the window they land in
+    std::string big(1 << 20, 'x');
+    AVLTree* file = new AVLTree();
+    insert_text(file, 0, big.data(), big.size());
+    Buffer* original = file->root->chunk.buf;
+    AVLTree* dup = substr(file, 0, big.size());
+    set_char(file, 1000, 'y');
+    pos = 1000;
+    AVLNode* written = node_at_char(file->root, &pos);
+    assert((written->chunk.length <= COW_WINDOW && written->chunk.buf != original) && "Write wasn't isolated");
+    pos = COW_WINDOW;
+    assert((node_at_char(file->root, &pos)->chunk.buf == original) && "Rest of the chunk left the shared buffer");
+    assert((dup->root->chunk.buf == original && original->data[1000] == 'x') && "Write leaked into the duplicate");
+    assert((get_chars(file->root) == big.size()) && "Write changed the length");
+
+    // sequential writes don't add a node per write
+    const uint32_t num_writes = 3 * COW_WINDOW;
+    for (uint32_t i = 0; i < num_writes; i++)
+        set_char(file, 2000 + i, 'z');
+    assert((get_size(file->root) <= 2 * (num_writes / COW_WINDOW + 2)) && "Writes fragmented the tree");
+    text.clear();
+    text_of(file->root, &text);
+    assert((text.compare(2000, num_writes, std::string(num_writes, 'z')) == 0) && "Sequential write got lost");
+    text.clear();
+    text_of(dup->root, &text);
+    assert((text == big) && "Writes leaked into the duplicate");
+    free_tree(dup);
+    free_tree(file);
+
+    // halves of one split chunk only share with each other, writes stay in place after the first
+    AVLTree* edit = new AVLTree();
+    std::string line(1000, 'a');
+    insert_text(edit, 0, line.data(), line.size());
+    insert_text(edit, 500, "b", 1);
+    for (uint32_t i = 0; i < 200; i++)
+        set_char(edit, 100 + i, 'c');
+    assert((get_size(edit->root) <= 4) && "Writes fragmented the tree");
+    free_tree(edit);
+
+    free_tree(sub);
+    free_tree(tree);
+    return true;
+}
+
 int main() {
     test_1();
     test_2();
+    test_3();
 }
@@ -2,13 +2,26 @@
 // This is string representation from the above paper, and is also used in cedar db
 // https://cedardb.com/blog/german_strings/
 
+#include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <ostream>
 #include <stdint.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 constexpr std::size_t SHORT_MAX = 12;
+// Top bit of length marks a long string whose payload lives in an InternTable,
+// so long strings are capped at 2^31 - 1 bytes.
+constexpr uint32_t INTERNED_BIT = 1u << 31;
+constexpr uint32_t LENGTH_MASK = INTERNED_BIT - 1;
 
 void print_char_array(const char* arr, size_t length) { fwrite(arr, sizeof(char), length, stdout); }
 
@@ -22,11 +35,74 @@ typedef struct {
             char prefix[4];      // 4 bytes for prefix
             const char* pointer; // 8 bytes for pointer/offset
         } long_str;
+        struct {
+            char prefix[4]; // 4 bytes for prefix
+            uint32_t id;    // 4 bytes for id into the InternTable
+        } interned_str;
     } content;
 } uString;
 
+// Interning table
+// Sharded hash set, every shard has its own lock so concurrent inserts only
+// contend when they hash to the same shard.
+// An id is (index within shard << SHARD_BITS) | shard, ids never change and
+// the payload bytes never move once inserted (deque doesn't relocate on push_back).
+constexpr uint32_t SHARD_BITS = 4;
+constexpr uint32_t NUM_SHARDS = 1u << SHARD_BITS;
+constexpr uint32_t SHARD_MASK = NUM_SHARDS - 1;
+
+typedef struct InternShard {
+    std::mutex lock;
+    std::deque<std::string> payloads;
+    std::unordered_map<std::string_view, uint32_t> ids; // views point into payloads
+} InternShard;
+
+typedef struct InternTable {
+    InternShard shards[NUM_SHARDS];
+} InternTable;
+
+// Returns the id for data, inserting a copy of it if it isn't in the table yet.
+// Safe to call from multiple threads.
+uint32_t intern_payload(InternTable* table, const char* data, std::size_t length) {
+    std::string_view key(data, length);
+    uint32_t shard_idx = std::hash<std::string_view>{}(key) % NUM_SHARDS;
+    InternShard* shard = &table->shards[shard_idx];
+
+    std::lock_guard<std::mutex> guard(shard->lock);
+    auto found = shard->ids.find(key);
+    if (found != shard->ids.end())
+        return found->second;
+    assert((shard->payloads.size() < (1u << (32 - SHARD_BITS))) && "Intern shard is out of ids");
+    uint32_t id = ((uint32_t)shard->payloads.size() << SHARD_BITS) | shard_idx;
+    const std::string& stored = shard->payloads.emplace_back(data, length);
+    shard->ids.emplace(std::string_view(stored), id);
+    return id;
+}
+
+// Returned pointer stays valid for the lifetime of the table.
+const char* lookup_payload(InternTable* table, uint32_t id) {
+    InternShard* shard = &table->shards[id & SHARD_MASK];
+    std::lock_guard<std::mutex> guard(shard->lock);
+    assert(((id >> SHARD_BITS) < shard->payloads.size()) && "Id is not in the intern table");
+    return shard->payloads[id >> SHARD_BITS].data();
+}
+
+std::size_t intern_table_size(InternTable* table) {
+    std::size_t total = 0;
+    for (uint32_t i = 0; i < NUM_SHARDS; i++) {
+        std::lock_guard<std::mutex> guard(table->shards[i].lock);
+        total += table->shards[i].payloads.size();
+    }
+    return total;
+}
+
+uint32_t get_length(const uString* str) { return str->length & LENGTH_MASK; }
+
+bool is_interned(const uString* str) { return (str->length & INTERNED_BIT) != 0; }
+
 void init_uString(uString* str, const char* data) {
     std::size_t length = strlen(data);
+    assert((length <= LENGTH_MASK) && "String is too long for uString");
     str->length = length;
     std::cout << "the length is " << length << std::endl;
 
@@ -38,13 +114,101 @@ void init_uString(uString* str, const char* data) {
     }
 }
 
-void print_uString(uString* str) {
-    if (str->length <= 12) {
-        std::cout << str->content.short_str.data << std::endl;
+// Same as init_uString, but long payloads get stored once in the table
+// and the uString carries the id instead of the pointer.
+void init_interned_uString(uString* str, InternTable* table, const char* data) {
+    std::size_t length = strlen(data);
+    assert((length <= LENGTH_MASK) && "String is too long to intern");
+    memset(str, 0, sizeof(uString));
+    if (length <= SHORT_MAX) {
+        str->length = length;
+        memcpy(str->content.short_str.data, data, length);
+    } else {
+        str->length = length | INTERNED_BIT;
+        memcpy(str->content.interned_str.prefix, data, 4);
+        str->content.interned_str.id = intern_payload(table, data, length);
+    }
+}
+
+// table can be nullptr if neither string is interned.
+const char* get_payload(const uString* str, InternTable* table) {
+    if (get_length(str) <= SHORT_MAX)
+        return str->content.short_str.data;
+    if (is_interned(str)) {
+        assert((table != nullptr) && "Interned string needs its table");
+        return lookup_payload(table, str->content.interned_str.id);
+    }
+    return str->content.long_str.pointer;
+}
+
+// Length and prefix are checked first, if both strings are interned in the
+// same table the payload comparison is just the id comparison.
+bool uString_equals(const uString* a, const uString* b, InternTable* table) {
+    uint32_t length = get_length(a);
+    if (length != get_length(b))
+        return false;
+    if (length <= SHORT_MAX)
+        return memcmp(a->content.short_str.data, b->content.short_str.data, length) == 0;
+    if (memcmp(a->content.long_str.prefix, b->content.long_str.prefix, 4) != 0)
+        return false;
+    if (is_interned(a) && is_interned(b))
+        return a->content.interned_str.id == b->content.interned_str.id;
+    return memcmp(get_payload(a, table), get_payload(b, table), length) == 0;
+}
+
+void print_uString(uString* str, InternTable* table = nullptr) {
+    uint32_t length = get_length(str);
+    if (length <= SHORT_MAX) {
+        print_char_array(str->content.short_str.data, length);
+        std::cout << std::endl;
     } else {
-        std::cout << "Prefix: " << str->content.long_str.prefix << std::endl;
-        print_char_array(str->content.long_str.pointer, str->length);
+        std::cout << "Prefix: ";
+        print_char_array(str->content.long_str.prefix, 4);
+        std::cout << std::endl;
+        print_char_array(get_payload(str, table), length);
+        std::cout << std::endl;
+    }
+}
+
+// Interns the same handful of strings from several threads,
+// every thread has to end up with the same ids.
+bool test_intern() {
+    const char* words[] = {"Welcome World!", "Hello!", "Welcome World!", "a much longer payload string",
+                           "a much longer payload string", "another long payload"};
+    const std::size_t num_words = sizeof(words) / sizeof(words[0]);
+    const std::size_t num_threads = 4;
+
+    InternTable* table = new InternTable();
+    std::vector<std::vector<uString>> results(num_threads, std::vector<uString>(num_words));
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            for (std::size_t i = 0; i < num_words; i++)
+                init_interned_uString(&results[t][i], table, words[i]);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // "Hello!" is short and never goes into the table
+    assert((intern_table_size(table) == 3) && "Duplicate payloads got stored more than once");
+    for (std::size_t t = 0; t < num_threads; t++) {
+        for (std::size_t i = 0; i < num_words; i++) {
+            assert(uString_equals(&results[0][i], &results[t][i], table) && "Threads got different ids");
+            assert((memcmp(get_payload(&results[t][i], table), words[i], strlen(words[i])) == 0) &&
+                   "Payload doesn't match");
+        }
     }
+    assert(uString_equals(&results[0][0], &results[0][2], table) && "Same payload isn't equal");
+    assert(!uString_equals(&results[0][0], &results[0][3], table) && "Different payloads are equal");
+
+    // interned and pointer backed strings still compare by payload
+    uString plain;
+    init_uString(&plain, words[3]);
+    assert(uString_equals(&plain, &results[0][4], table) && "Mixed comparison failed");
+    print_uString(&results[0][3], table);
+    delete table;
+    return true;
 }
 
 int main() {
@@ -54,5 +218,6 @@ int main() {
     init_uString(str, arr);
     print_uString(str);
     free(str);
+    test_intern();
     return 0;
 }